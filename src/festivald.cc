@@ -45,8 +45,14 @@
 #include <cstring>
 #include <iostream>
 #include <sstream>
+#include <string>
+#include <vector>
 
 // POSIX includes
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/wait.h>
@@ -63,7 +69,16 @@
 #include <festival.h>
 #include <siod.h> /* repl_from_socket */
 
+#include "festivald_clock.h"
+#include "festivald_profile.h"
+#include "festivald_spool.h"
+
 #define DEFAULT_MAX_CLIENTS 10
+#define DEFAULT_SEND_BUFFER 67108864
+#define DEFAULT_MAX_BUFFERED 268435456
+#define DEFAULT_IDLE_TIMEOUT 0
+#define RELAY_CHUNK_SIZE 65536
+#define RELAY_INPUT_LIMIT 1048576
 #define FESTIVALD_HEAP_SIZE 10000000
 
 #ifdef WITH_SYSTEMD
@@ -76,9 +91,43 @@ static const char* festivald_version = "0.1";
 
 static int festivald(int* f_socket, const char* socket_path,
                      bool* socket_created);
-static int festival_accept_connections(int fd, int max_clients);
+struct festivald_server;
+static void festivald_initialize(int load_init_files, long int heap_size,
+                                 bool profile);
+static int festivald_zygote(festivald_server& server, int load_init_files,
+                            long int heap_size, bool profile);
+static int festival_accept_connections(festivald_server& server);
 static void log_message(int client, const char* message);
 
+/* A connected client. The master relays the bytes between the client socket
+ * and a socketpair shared with the worker, buffering the worker output, so
+ * the worker does not wait for slow clients to read their waveforms */
+struct festivald_conn {
+    int client_name;
+    int client_fd;         // -1 once the client is gone
+    int worker_fd;         // master end of the socketpair, -1 once closed
+    bool client_eof;       // the client will not send more commands
+    bool worker_shut;      // the worker will not receive more commands
+    std::string to_worker; // client commands not yet given to the worker
+    std::string to_client; // worker output not yet sent to the client
+    size_t to_client_sent;
+};
+
+/* State of the master process */
+struct festivald_server {
+    int fd; // listening socket
+    int max_clients;
+    long int send_buffer;
+    long int max_buffered;
+    int idle_timeout;        // seconds idle before exiting, 0 to never exit
+    festivald_spool* spool;  // NULL unless in spool mode
+    int zygote_fd;           // -1 unless festival initializes in the zygote
+    double started;          // when the festivald process started
+    double first_accept;     // when the first client connected, 0 before
+    bool replied;            // a client got a reply since festivald started
+    std::vector<festivald_conn> conns;
+};
+
 /* Handles the command line arguments, initializes festival and calls the
  * socket accept/create function */
 int main(int argc, char** argv) {
@@ -87,7 +136,20 @@ int main(int argc, char** argv) {
     EST_StrList extra_args; // Needed by API, speech tools but ignored
     long int heap_size = 0;
     int max_clients = DEFAULT_MAX_CLIENTS;
+    long int send_buffer = DEFAULT_SEND_BUFFER;
+    long int max_buffered = DEFAULT_MAX_BUFFERED;
+    int idle_timeout = DEFAULT_IDLE_TIMEOUT;
+    bool deferred_init = false;
+    bool profile = false;
     const char* socket_path = DEFAULT_SOCKET_PATH;
+    const char* spool_path = NULL;
+    const char* spool_output = NULL;
+    int spool_jobs = DEFAULT_SPOOL_JOBS;
+    festivald_spool spool;
+    festivald_server server;
+
+    // Under socket activation this is about when the first client connected
+    server.started = festivald_now();
     parse_command_line(
         argc, argv,
         EST_String("Usage:\n") + "festivald  <options>\n" + "festivald " +
@@ -103,6 +165,29 @@ int main(int argc, char** argv) {
             "--max-clients <int> {10}\n" + "              Max. number of "
                                            "clients allowed to connect to the "
                                            "server\n" +
+            "--send-buffer <int> {67108864}\n" +
+            "              Max. bytes of output buffered per client before\n" +
+            "              its worker has to wait for the client to read\n" +
+            "--max-buffered <int> {268435456}\n" +
+            "              Max. bytes of output buffered for all clients\n" +
+            "--spool <string>\n" +
+            "              Render the *.txt files of this directory, or the\n" +
+            "              text files listed in this manifest, to waveforms\n" +
+            "--spool-output <string>\n" +
+            "              Directory for the spool waveforms and journal\n" +
+            "              (default is the spool or manifest directory)\n" +
+            "--spool-jobs <int> {1}\n" +
+            "              Max. number of clients used by the spool, the\n" +
+            "              rest are kept for interactive clients\n" +
+            "--idle-timeout <int> {0}\n" +
+            "              Exit after this many seconds without clients,\n" +
+            "              for socket activation (0 never exits)\n" +
+            "--deferred-init\n" +
+            "              Accept clients right away and queue them while\n" +
+            "              festival initializes in the background\n" +
+            "--profile-startup\n" +
+            "              Report the time spent loading each init file and\n" +
+            "              voice\n" +
             "--heap <int> {10000000}\n" +
             "              Set size of Lisp heap, should not normally need\n" +
             "              to be changed from its default\n" +
@@ -158,6 +243,30 @@ int main(int argc, char** argv) {
     if (max_clients < 0)
         max_clients = DEFAULT_MAX_CLIENTS;
 
+    // Set send_buffer
+    if (al.present("--send-buffer"))
+        send_buffer = al.ival("--send-buffer");
+    else if (getenv("FESTIVALD_SEND_BUFFER") != 0)
+        send_buffer = strtol(getenv("FESTIVALD_SEND_BUFFER"), NULL, 10);
+    else
+        send_buffer = DEFAULT_SEND_BUFFER;
+
+    // Validate send_buffer
+    if (send_buffer <= 0)
+        send_buffer = DEFAULT_SEND_BUFFER;
+
+    // Set max_buffered
+    if (al.present("--max-buffered"))
+        max_buffered = al.ival("--max-buffered");
+    else if (getenv("FESTIVALD_MAX_BUFFERED") != 0)
+        max_buffered = strtol(getenv("FESTIVALD_MAX_BUFFERED"), NULL, 10);
+    else
+        max_buffered = DEFAULT_MAX_BUFFERED;
+
+    // Validate max_buffered
+    if (max_buffered <= 0)
+        max_buffered = DEFAULT_MAX_BUFFERED;
+
     if (al.present("--socket"))
         socket_path = al.val("--socket");
     else if (getenv("FESTIVALD_SOCKET_PATH") != 0)
@@ -165,7 +274,72 @@ int main(int argc, char** argv) {
     else
         socket_path = DEFAULT_SOCKET_PATH;
 
-    festival_initialize(load_init_files, heap_size);
+    // Set idle_timeout
+    if (al.present("--idle-timeout"))
+        idle_timeout = al.ival("--idle-timeout");
+    else if (getenv("FESTIVALD_IDLE_TIMEOUT") != 0)
+        idle_timeout = strtol(getenv("FESTIVALD_IDLE_TIMEOUT"), NULL, 10);
+    else
+        idle_timeout = DEFAULT_IDLE_TIMEOUT;
+
+    // Validate idle_timeout
+    if (idle_timeout < 0)
+        idle_timeout = DEFAULT_IDLE_TIMEOUT;
+
+    if (al.present("--deferred-init"))
+        deferred_init = true;
+    else if (getenv("FESTIVALD_DEFERRED_INIT") != 0)
+        deferred_init = strtol(getenv("FESTIVALD_DEFERRED_INIT"), NULL, 10);
+
+    if (al.present("--profile-startup"))
+        profile = true;
+    else if (getenv("FESTIVALD_PROFILE_STARTUP") != 0)
+        profile = strtol(getenv("FESTIVALD_PROFILE_STARTUP"), NULL, 10);
+
+    if (al.present("--spool"))
+        spool_path = al.val("--spool");
+    else if (getenv("FESTIVALD_SPOOL") != 0)
+        spool_path = getenv("FESTIVALD_SPOOL");
+
+    if (al.present("--spool-output"))
+        spool_output = al.val("--spool-output");
+    else if (getenv("FESTIVALD_SPOOL_OUTPUT") != 0)
+        spool_output = getenv("FESTIVALD_SPOOL_OUTPUT");
+
+    // Set spool_jobs
+    if (al.present("--spool-jobs"))
+        spool_jobs = al.ival("--spool-jobs");
+    else if (getenv("FESTIVALD_SPOOL_JOBS") != 0)
+        spool_jobs = strtol(getenv("FESTIVALD_SPOOL_JOBS"), NULL, 10);
+    else
+        spool_jobs = DEFAULT_SPOOL_JOBS;
+
+    // Validate spool_jobs, keeping at least one client for interactive use
+    if (spool_jobs <= 0)
+        spool_jobs = DEFAULT_SPOOL_JOBS;
+    if (spool_jobs >= max_clients)
+        spool_jobs = max_clients - 1;
+    if (spool_path != NULL && spool_jobs <= 0) {
+        std::cerr << "Spool mode needs --max-clients of at least 2"
+                  << std::endl;
+        return 1;
+    }
+
+    if (spool_path != NULL &&
+        spool_init(spool, spool_path, spool_output, spool_jobs) < 0)
+        return 1;
+
+    server.max_clients = max_clients;
+    server.send_buffer = send_buffer;
+    server.max_buffered = max_buffered;
+    server.idle_timeout = idle_timeout;
+    server.spool = spool_path ? &spool : NULL;
+    server.zygote_fd = -1;
+    server.first_accept = 0;
+    server.replied = false;
+
+    if (!deferred_init)
+        festivald_initialize(load_init_files, heap_size, profile);
     /* Gets the socket from systemd or creates one at the socket path */
     int f_socket = -1;
     bool socket_created = false;
@@ -175,7 +349,22 @@ int main(int argc, char** argv) {
         }
         return 1;
     }
-    int retval = festival_accept_connections(f_socket, max_clients);
+    server.fd = f_socket;
+    // Nothing would start festivald again on a socket of its own
+    if (socket_created && server.idle_timeout > 0) {
+        std::cerr << "Ignoring --idle-timeout, it needs a systemd socket"
+                  << std::endl;
+        server.idle_timeout = 0;
+    }
+    if (deferred_init &&
+        festivald_zygote(server, load_init_files, heap_size, profile) < 0) {
+        if (socket_created) {
+            unlink(socket_path);
+        }
+        close(f_socket);
+        return 1;
+    }
+    int retval = festival_accept_connections(server);
     if (socket_created) {
         unlink(socket_path);
     }
@@ -252,38 +441,517 @@ static int festivald(int* f_socket, const char* socket_path,
     return festivald_nosystemd(f_socket, socket_path, socket_created);
 }
 
-static int festival_accept_connections(int fd, int max_clients) {
-    int fd1, statusp;
-    int client_name = 0, num_clients = 0;
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static bool would_block(void) {
+    return (errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR);
+}
+
+/* Appends what is available on fd to buf.
+ * Returns the number of bytes read, 0 on end of file or -1 on error */
+static ssize_t relay_read(int fd, std::string& buf) {
+    char chunk[RELAY_CHUNK_SIZE];
+    ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+    if (n > 0)
+        buf.append(chunk, n);
+    return n;
+}
+
+/* Sends buf from offset *sent on, advancing *sent.
+ * Returns -1 on error */
+static ssize_t relay_write(int fd, std::string& buf, size_t* sent) {
+    ssize_t n =
+        send(fd, buf.data() + *sent, buf.size() - *sent, MSG_NOSIGNAL);
+    if (n < 0)
+        return n;
+    *sent += n;
+    if (*sent == buf.size()) {
+        buf.clear();
+        *sent = 0;
+    } else if (*sent > buf.size() / 2) {
+        // Compacting only past half keeps the copies linear in the output
+        buf.erase(0, *sent);
+        *sent = 0;
+    }
+    return n;
+}
+
+static void conn_close_client(festivald_conn& c) {
+    if (c.client_fd != -1)
+        close(c.client_fd);
+    c.client_fd = -1;
+    c.client_eof = true;
+    c.to_client.clear();
+    c.to_client_sent = 0;
+}
+
+static void conn_close_worker(festivald_conn& c) {
+    if (c.worker_fd != -1)
+        close(c.worker_fd);
+    c.worker_fd = -1;
+    c.worker_shut = true;
+    c.to_worker.clear();
+}
+
+/* Relays the client events of a connection.
+ * Returns the number of bytes sent to the client */
+static ssize_t relay_client_events(festivald_conn& c, const struct pollfd& p) {
+    ssize_t sent = 0;
+    if (c.client_fd == -1 || p.revents == 0)
+        return 0;
+    if ((p.events & POLLIN) && (p.revents & (POLLIN | POLLHUP | POLLERR))) {
+        std::string discarded;
+        ssize_t n =
+            relay_read(c.client_fd, c.worker_shut ? discarded : c.to_worker);
+        if (n == 0) {
+            c.client_eof = true;
+        } else if (n < 0 && !would_block()) {
+            conn_close_client(c);
+            return 0;
+        }
+    }
+    if ((p.events & POLLOUT) && (p.revents & (POLLOUT | POLLHUP | POLLERR))) {
+        sent = relay_write(c.client_fd, c.to_client, &c.to_client_sent);
+        if (sent < 0 && !would_block())
+            conn_close_client(c);
+    }
+    return sent > 0 ? sent : 0;
+}
+
+static void relay_worker_events(festivald_conn& c, const struct pollfd& p) {
+    if (c.worker_fd == -1 || p.revents == 0)
+        return;
+    if ((p.events & POLLIN) && (p.revents & (POLLIN | POLLHUP | POLLERR))) {
+        std::string discarded;
+        ssize_t n =
+            relay_read(c.worker_fd, c.client_fd == -1 ? discarded : c.to_client);
+        if (n == 0 || (n < 0 && !would_block())) {
+            conn_close_worker(c);
+            return;
+        }
+    }
+    if ((p.events & POLLOUT) && (p.revents & (POLLOUT | POLLHUP | POLLERR))) {
+        ssize_t n = send(c.worker_fd, c.to_worker.data(), c.to_worker.size(),
+                         MSG_NOSIGNAL);
+        if (n > 0) {
+            c.to_worker.erase(0, n);
+        } else if (n < 0 && !would_block()) {
+            // The worker stopped reading, but its output may still be queued
+            c.to_worker.clear();
+            c.worker_shut = true;
+        }
+    }
+}
+
+/* Closes in a freshly forked process the descriptors owned by the master */
+static void close_master_fds(const festivald_server& server) {
+    close(server.fd);
+    if (server.zygote_fd != -1)
+        close(server.zygote_fd);
+    if (server.spool != NULL)
+        spool_close_fds(*server.spool);
+    for (size_t i = 0; i < server.conns.size(); i++) {
+        if (server.conns[i].client_fd != -1)
+            close(server.conns[i].client_fd);
+        if (server.conns[i].worker_fd != -1)
+            close(server.conns[i].worker_fd);
+    }
+}
+
+/* Body of a worker: the festival interpreter for a client on worker_fd, or
+ * the rendering of a spool job reporting to worker_fd. Never returns */
+static void run_worker(int client_name, festivald_spool_job* job,
+                       int worker_fd) {
+    if (job != NULL) {
+        job->result_fd = worker_fd;
+        exit(spool_render(*job) < 0 ? 1 : 0);
+    }
+    ft_server_socket = worker_fd;
+    log_message(client_name, "connected");
+    repl_from_socket(worker_fd);
+    log_message(client_name, "disconnected");
+    exit(0);
+}
+
+/* Sends len bytes of buf and the descriptor fd over the unix socket sock */
+static int send_fd(int sock, const void* buf, size_t len, int fd) {
+    struct msghdr msg;
+    struct iovec iov;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    iov.iov_base = const_cast<void*>(buf);
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    while (sendmsg(sock, &msg, MSG_NOSIGNAL) < 0) {
+        if (errno != EINTR)
+            return -1;
+    }
+    return 0;
+}
+
+/* Receives a message and a descriptor (-1 if none) sent with send_fd().
+ * Returns the message length, 0 on end of file or -1 on error */
+static ssize_t recv_fd(int sock, void* buf, size_t len, int* fd) {
+    struct msghdr msg;
+    struct iovec iov;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    ssize_t n;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    *fd = -1;
+    if ((n = recvmsg(sock, &msg, 0)) <= 0)
+        return n;
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type == SCM_RIGHTS)
+        memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    return n;
+}
+
+/* Starts a worker on worker_fd, forking it from the master or, when the
+ * initialization is deferred, asking the zygote to fork it. A spool job
+ * travels as its client number 0 followed by its text and output paths.
+ * master_fd is the master end of worker_fd, to close in the worker.
+ * Returns 0 if ok, <0 on error */
+static int launch_worker(const festivald_server& server, int client_name,
+                         festivald_spool_job* job, int worker_fd,
+                         int master_fd) {
     pid_t pid;
 
-    while (1) // never exits except by signals
-    {
-        if ((fd1 = accept(fd, 0, 0)) < 0) {
-            std::cerr << "socket: accept failed";
-            return 1;
+    if (server.zygote_fd != -1) {
+        std::string msg((const char*)&client_name, sizeof(client_name));
+        if (job != NULL) {
+            msg.append(job->text_file.c_str(), job->text_file.size() + 1);
+            msg.append(job->output.c_str(), job->output.size() + 1);
         }
-        client_name++;
-        num_clients++;
-
-        // Fork new image of festival and call interpreter
-        if (num_clients > max_clients) {
-            log_message(client_name, "failed: too many clients");
-            num_clients--;
-        } else if ((pid = fork()) == 0) {
-            ft_server_socket = fd1;
-            log_message(client_name, "connected");
-            repl_from_socket(fd1);
-            log_message(client_name, "disconnected");
-            exit(0);
+        return send_fd(server.zygote_fd, msg.data(), msg.size(), worker_fd);
+    }
+    if ((pid = fork()) == 0) {
+        close_master_fds(server);
+        close(master_fd);
+        run_worker(client_name, job, worker_fd);
+    }
+    return pid < 0 ? -1 : 0;
+}
+
+/* Body of the zygote: initializes festival, then forks a worker for every
+ * descriptor the master sends. Never returns */
+static void run_zygote(int ctl, int load_init_files, long int heap_size,
+                       bool profile) {
+    char msg[sizeof(int) + 2 * PATH_MAX];
+    int client_name, worker_fd;
+    ssize_t n;
+    pid_t pid;
+
+    // Workers are reaped by the system, the master tracks them by their fds
+    signal(SIGCHLD, SIG_IGN);
+    festivald_initialize(load_init_files, heap_size, profile);
+    while ((n = recv_fd(ctl, msg, sizeof(msg) - 2, &worker_fd)) != 0) {
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            exit(1);
+        if (worker_fd == -1 || n < (ssize_t)sizeof(int))
+            continue;
+        memcpy(&client_name, msg, sizeof(int));
+        if ((pid = fork()) == 0) {
+            festivald_spool_job job;
+            close(ctl);
+            signal(SIGCHLD, SIG_DFL);
+            if (client_name != 0)
+                run_worker(client_name, NULL, worker_fd);
+            msg[n] = msg[n + 1] = '\0';
+            job.text_file = msg + sizeof(int);
+            job.output = msg + sizeof(int) + job.text_file.size() + 1;
+            run_worker(0, &job, worker_fd);
         } else if (pid < 0) {
             log_message(client_name, "failed to fork new client");
-            num_clients--;
+        }
+        close(worker_fd);
+    }
+    exit(0);
+}
+
+/* Forks the zygote that initializes festival in the background and forks
+ * the workers afterwards, so that the master can accept clients meanwhile.
+ * Returns 0 if ok, <0 on error */
+static int festivald_zygote(festivald_server& server, int load_init_files,
+                            long int heap_size, bool profile) {
+    int sv[2];
+    pid_t pid;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0) {
+        std::cerr << "socketpair(): " << strerror(errno) << std::endl;
+        return -1;
+    }
+    if ((pid = fork()) == 0) {
+        close_master_fds(server);
+        close(sv[0]);
+        run_zygote(sv[1], load_init_files, heap_size, profile);
+    } else if (pid < 0) {
+        std::cerr << "fork(): " << strerror(errno) << std::endl;
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    close(sv[1]);
+    server.zygote_fd = sv[0];
+    return 0;
+}
+
+/* Starts a worker running the festival interpreter on one end of a
+ * socketpair and registers the client so its traffic is relayed from the
+ * other end.
+ * Returns 0 if ok, <0 on error (the client socket is then left open) */
+static int spawn_worker(festivald_server& server, int fd1, int client_name) {
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        log_message(client_name, "failed to create worker socket");
+        return -1;
+    }
+    if (launch_worker(server, client_name, NULL, sv[1], sv[0]) < 0) {
+        log_message(client_name, "failed to fork new client");
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    close(sv[1]);
+    set_nonblocking(fd1);
+    set_nonblocking(sv[0]);
+
+    festivald_conn c;
+    c.client_name = client_name;
+    c.client_fd = fd1;
+    c.worker_fd = sv[0];
+    c.client_eof = false;
+    c.worker_shut = false;
+    c.to_client_sent = 0;
+    server.conns.push_back(c);
+    return 0;
+}
+
+/* Starts a worker rendering the next spool file, if any.
+ * Returns 0 if a worker was started, <0 otherwise */
+static int spawn_spool_worker(festivald_server& server) {
+    festivald_spool* spool = server.spool;
+    festivald_spool_job job;
+    int result[2];
+
+    if (!spool_next_job(*spool, job))
+        return -1;
+    if (pipe(result) < 0) {
+        std::cerr << "spool: pipe(): " << strerror(errno) << std::endl;
+        spool->pending.push_front(job.input);
+        return -1;
+    }
+    if (launch_worker(server, 0, &job, result[1], result[0]) < 0) {
+        std::cerr << "spool: failed to fork worker" << std::endl;
+        spool->pending.push_front(job.input);
+        close(result[0]);
+        close(result[1]);
+        return -1;
+    }
+    close(result[1]);
+    job.result_fd = result[0];
+    spool_job_started(*spool, job);
+    return 0;
+}
+
+/* Initializes festival, reporting how long it took */
+static void festivald_initialize(int load_init_files, long int heap_size,
+                                 bool profile) {
+    double start = festivald_now();
+    char message[96];
+
+    if (profile)
+        festivald_profile_initialize(load_init_files, heap_size);
+    else
+        festival_initialize(load_init_files, heap_size);
+    snprintf(message, sizeof(message), "initialized in %.3f s",
+             festivald_now() - start);
+    log_message(0, message);
+}
+
+static int festival_accept_connections(festivald_server& server) {
+    int fd1, statusp;
+    int client_name = 0;
+    std::vector<festivald_conn>& conns = server.conns;
+    festivald_spool* spool = server.spool;
+    std::vector<struct pollfd> fds;
+    double last_active = festivald_now();
+    char message[128];
+
+    while (1) // exits when idle for idle_timeout, or by signals
+    {
+        // A worker takes a client slot until it exits, even if the master is
+        // still sending its output to the client
+        int num_clients = spool ? spool->running.size() : 0;
+        // Draining clients do not take slots, but their output is bounded.
+        // Over max_buffered, only clients above their fair share wait
+        size_t buffered = 0;
+        for (size_t i = 0; i < conns.size(); i++)
+            buffered += conns[i].to_client.size() - conns[i].to_client_sent;
+        size_t fair_share = conns.empty()
+                                ? (size_t)server.max_buffered
+                                : (size_t)server.max_buffered / conns.size();
+        fds.resize(2 + 2 * conns.size());
+        fds[0].fd = server.fd;
+        fds[0].events = POLLIN;
+        // POLLHUP tells that the zygote is gone
+        fds[1].fd = server.zygote_fd;
+        fds[1].events = 0;
+        for (size_t i = 0; i < conns.size(); i++) {
+            festivald_conn& c = conns[i];
+            struct pollfd& pc = fds[2 + 2 * i];
+            struct pollfd& pw = fds[3 + 2 * i];
+            size_t pending = c.to_client.size() - c.to_client_sent;
+
+            pc.events = 0;
+            if (!c.client_eof && c.to_worker.size() < RELAY_INPUT_LIMIT)
+                pc.events |= POLLIN;
+            if (pending > 0)
+                pc.events |= POLLOUT;
+            pc.fd = (c.client_fd != -1 && pc.events != 0) ? c.client_fd : -1;
+
+            pw.events = 0;
+            if (pending < (size_t)server.send_buffer &&
+                (buffered < (size_t)server.max_buffered ||
+                 pending < fair_share))
+                pw.events |= POLLIN;
+            if (!c.to_worker.empty())
+                pw.events |= POLLOUT;
+            pw.fd = (c.worker_fd != -1 && pw.events != 0) ? c.worker_fd : -1;
+
+            if (c.worker_fd != -1)
+                num_clients++;
+        }
+
+        // The spool gets the clients left, up to its own limit
+        while (spool != NULL && num_clients < server.max_clients &&
+               spawn_spool_worker(server) == 0)
+            num_clients++;
+
+        size_t spool_fds = fds.size();
+        int timeout = -1;
+        if (spool != NULL) {
+            spool_poll_fds(*spool, fds);
+            timeout = spool_timeout(*spool);
+        }
+
+        // Socket activation starts festivald again on the next client
+        double now = festivald_now();
+        if (!conns.empty() ||
+            (spool && !(spool->running.empty() && spool->pending.empty())))
+            last_active = now;
+        if (server.idle_timeout > 0) {
+            double idle_left = last_active + server.idle_timeout - now;
+            if (idle_left <= 0) {
+                // A client may have connected since the last poll()
+                struct pollfd listening = {server.fd, POLLIN, 0};
+                if (poll(&listening, 1, 0) == 0) {
+                    snprintf(message, sizeof(message),
+                             "idle for %d s, exiting", server.idle_timeout);
+                    log_message(0, message);
+                    return 0;
+                }
+                last_active = now;
+                idle_left = server.idle_timeout;
+            }
+            if (timeout < 0 || idle_left * 1000 < timeout)
+                timeout = (int)(idle_left * 1000) + 1;
+        }
+
+        if (poll(&fds[0], fds.size(), timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            std::cerr << "poll(): " << strerror(errno) << std::endl;
+            return 1;
+        }
+        if (fds[1].revents & (POLLHUP | POLLERR)) {
+            log_message(0, "festival initialization failed");
+            return 1;
+        }
+
+        for (size_t i = 0; i < conns.size(); i++) {
+            if (relay_client_events(conns[i], fds[2 + 2 * i]) > 0 &&
+                !server.replied) {
+                server.replied = true;
+                snprintf(message, sizeof(message),
+                         "first reply sent %.3f s after festivald started, "
+                         "%.3f s after the first client connected",
+                         festivald_now() - server.started,
+                         festivald_now() - server.first_accept);
+                log_message(conns[i].client_name, message);
+            }
+            relay_worker_events(conns[i], fds[3 + 2 * i]);
+        }
+        if (spool != NULL)
+            spool_handle_events(*spool, fds.data() + spool_fds);
+
+        // Tell workers that their clients are done, and forget the
+        // connections that have nothing left to relay
+        for (size_t i = conns.size(); i-- > 0;) {
+            festivald_conn& c = conns[i];
+            if (c.client_eof && c.to_worker.empty() && !c.worker_shut) {
+                shutdown(c.worker_fd, SHUT_WR);
+                c.worker_shut = true;
+            }
+            if (c.client_fd == -1 && c.to_worker.empty())
+                conn_close_worker(c);
+            if (c.worker_fd == -1 && c.to_client.empty())
+                conn_close_client(c);
+            if (c.client_fd == -1 && c.worker_fd == -1)
+                conns.erase(conns.begin() + i);
+        }
+
+        if (fds[0].revents & POLLIN) {
+            if ((fd1 = accept(server.fd, 0, 0)) < 0) {
+                std::cerr << "socket: accept failed";
+                return 1;
+            }
+            client_name++;
+            if (server.first_accept == 0)
+                server.first_accept = festivald_now();
+
+            // Fork new image of festival and call interpreter
+            if (num_clients >= server.max_clients) {
+                log_message(client_name, "failed: too many clients");
+                close(fd1);
+            } else if (spawn_worker(server, fd1, client_name) < 0) {
+                close(fd1);
+            }
         }
 
-        while ((num_clients > 0) && (waitpid(0, &statusp, WNOHANG) != 0))
-            num_clients--;
-        close(fd1);
+        while (waitpid(-1, &statusp, WNOHANG) > 0)
+            ;
     }
     return 0;
 }
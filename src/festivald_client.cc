@@ -46,6 +46,7 @@
 #include <sstream>
 
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/un.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -61,7 +62,7 @@ using namespace std;
 
 typedef FILE* SERVER_FD;
 
-static void copy_to_server(FILE* fdin, SERVER_FD serverfd);
+static void copy_to_server(FILE* fdin, SERVER_FD serverfd, int last);
 static void ttw_file(SERVER_FD serverfd, const EST_String& file);
 static void client_accept_waveform(SERVER_FD fd);
 static void client_accept_s_expr(SERVER_FD fd);
@@ -184,7 +185,7 @@ int main(int argc, char** argv) {
                  << al.val("--prolog") << "\"" << endl;
             return 1;
         }
-        copy_to_server(pfd, serverfd);
+        copy_to_server(pfd, serverfd, FALSE);
         fclose(pfd);
     }
 
@@ -192,14 +193,14 @@ int main(int argc, char** argv) {
         ttw_file(serverfd, files.nth(0));
     else {
         if ((files.length() == 0) || (files.nth(0) == "-"))
-            copy_to_server(stdin, serverfd);
+            copy_to_server(stdin, serverfd, TRUE);
         else {
             if ((infd = fopen(files.nth(0), "rb")) == NULL) {
                 cerr << "festivald_client: can't open \"" << files.nth(0)
                      << "\"\n";
                 return 1;
             }
-            copy_to_server(infd, serverfd);
+            copy_to_server(infd, serverfd, TRUE);
         }
     }
 
@@ -259,13 +260,35 @@ static void ttw_file(SERVER_FD serverfd, const EST_String& file) {
              << "\" mysteriously disappeared\n";
         exit(-1);
     }
-    copy_to_server(fd, serverfd);
+    copy_to_server(fd, serverfd, TRUE);
     fclose(fd);
     unlink(tmpfile);
 }
 
-static void copy_to_server(FILE* fdin, SERVER_FD serverfd) {
-    // Open a connection and copy everything from fdin to server
+static int at_end_of_input(FILE* fdin) {
+    // Skips the whitespace left in fdin and tells if nothing else follows.
+    // Only regular files are peeked: reading a pipe, FIFO or terminal could
+    // wait for input that comes later, so those get closed after the loop
+    struct stat st;
+    int c;
+
+    if (fstat(fileno(fdin), &st) != 0 || !S_ISREG(st.st_mode))
+        return FALSE;
+
+    while ((c = getc(fdin)) != EOF) {
+        if ((c != ' ') && (c != '\t') && (c != '\n') && (c != '\r')) {
+            ungetc(c, fdin);
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static void copy_to_server(FILE* fdin, SERVER_FD serverfd, int last) {
+    // Open a connection and copy everything from fdin to server.
+    // When fdin is the last input, the sending side of the connection is
+    // shut down as soon as the last command is sent, so festivald can release
+    // the server process while the replies are still being read
     int c, n;
     int state = 0;
     int bdepth = 0;
@@ -278,6 +301,8 @@ static void copy_to_server(FILE* fdin, SERVER_FD serverfd) {
         if (state == 1) {
             state = 0;
             fflush(serverfd);
+            if (last && at_end_of_input(fdin))
+                shutdown(fileno(serverfd), SHUT_WR);
             do {
                 for (n = 0; n < 3;)
                     n += read(fileno(serverfd), ack + n, 3 - n);
@@ -294,6 +319,10 @@ static void copy_to_server(FILE* fdin, SERVER_FD serverfd) {
             } while (!streq(ack, "OK\n"));
         }
     }
+    if (last) {
+        fflush(serverfd);
+        shutdown(fileno(serverfd), SHUT_WR);
+    }
 }
 
 static void new_state(int c, int& state, int& bdepth) {
@@ -0,0 +1,182 @@
+/*************************************************************************/
+/*                                                                       */
+/*                Centre for Speech Technology Research                  */
+/*                     University of Edinburgh, UK                       */
+/*                       Copyright (c) 1996,1997                         */
+/*           Sergio Oller Moreno, Barcelona, Spain (c) 2018              */
+/*                        All Rights Reserved.                           */
+/*                                                                       */
+/*  Permission is hereby granted, free of charge, to use and distribute  */
+/*  this software and its documentation without restriction, including   */
+/*  without limitation the rights to use, copy, modify, merge, publish,  */
+/*  distribute, sublicense, and/or sell copies of this work, and to      */
+/*  permit persons to whom this work is furnished to do so, subject to   */
+/*  the following conditions:                                            */
+/*   1. The code must retain the above copyright notice, this list of    */
+/*      conditions and the following disclaimer.                         */
+/*   2. Any modifications must be clearly marked as such.                */
+/*   3. Original authors' names are not deleted.                         */
+/*   4. The authors' names are not used to endorse or promote products   */
+/*      derived from this software without specific prior written        */
+/*      permission.                                                      */
+/*                                                                       */
+/*  THE UNIVERSITY OF EDINBURGH AND THE CONTRIBUTORS TO THIS WORK        */
+/*  DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE, INCLUDING      */
+/*  ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO EVENT   */
+/*  SHALL THE UNIVERSITY OF EDINBURGH NOR THE CONTRIBUTORS BE LIABLE     */
+/*  FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES    */
+/*  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN   */
+/*  AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION,          */
+/*  ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF       */
+/*  THIS SOFTWARE.                                                       */
+/*                                                                       */
+/*************************************************************************/
+/* Author : festivald contributors                                       */
+/*                                                                       */
+/* Startup profiler for festivald: time spent per init file and voice    */
+/*                                                                       */
+/*=======================================================================*/
+
+// Standard includes
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+// POSIX includes
+#include <unistd.h>
+
+// speech-tools and festival includes:
+#include <EST_String.h>
+#include <festival.h>
+#include <siod.h> /* init_subr_1 */
+
+#include "festivald_clock.h"
+#include "festivald_profile.h"
+
+/* A file being loaded */
+struct profile_frame {
+    std::string file;
+    double start;
+    double children; // seconds spent loading files from this one
+};
+
+static std::vector<profile_frame> profile_stack;
+static std::map<std::string, double> profile_voices;
+
+/* Scheme load wrapper, timing every file loaded while festival starts */
+static const char* profile_load_wrapper =
+    "(begin"
+    "  (define festivald.load load)"
+    "  (define (load file . args)"
+    "    (festivald.profile_begin file)"
+    "    (let ((result (apply festivald.load (cons file args))))"
+    "      (festivald.profile_end file)"
+    "      result)))";
+
+/* Voices are installed in <libdir>/voices/<language>/<voice>/ */
+static std::string voice_of(const std::string& file) {
+    size_t start = file.find("/voices/");
+    if (start == std::string::npos)
+        return "";
+    start = file.find('/', start + 8);
+    if (start == std::string::npos)
+        return "";
+    start++;
+    size_t end = file.find('/', start);
+    if (end == std::string::npos)
+        return "";
+    return file.substr(start, end - start);
+}
+
+static void profile_begin(const std::string& file) {
+    profile_frame frame;
+    frame.file = file;
+    frame.start = festivald_now();
+    frame.children = 0;
+    profile_stack.push_back(frame);
+}
+
+static void profile_end(const std::string& file) {
+    double now = festivald_now();
+    char report[64];
+
+    // A load aborted by an error never ends, drop it with the matching one
+    while (!profile_stack.empty()) {
+        profile_frame frame = profile_stack.back();
+        profile_stack.pop_back();
+        if (frame.file != file)
+            continue;
+
+        double spent = now - frame.start;
+        std::string voice = voice_of(file);
+        if (!profile_stack.empty())
+            profile_stack.back().children += spent;
+        if (!voice.empty() && (profile_stack.empty() ||
+                               voice_of(profile_stack.back().file) != voice))
+            profile_voices[voice] += spent;
+
+        snprintf(report, sizeof(report), "%*s%.3f s (self %.3f s) ",
+                 (int)(2 * profile_stack.size()), "", spent,
+                 spent - frame.children);
+        std::cerr << "startup: " << report << file << std::endl;
+        return;
+    }
+}
+
+static LISP festivald_profile_begin(LISP file) {
+    profile_begin(get_c_string(file));
+    return NIL;
+}
+
+static LISP festivald_profile_end(LISP file) {
+    profile_end(get_c_string(file));
+    return NIL;
+}
+
+/* Initializes festival like festival_initialize(), timing each file loaded
+ * from the default setup files and the voices they load */
+void festivald_profile_initialize(int load_init_files, long int heap_size) {
+    double start = festivald_now();
+    char report[64];
+
+    festival_initialize(FALSE, heap_size);
+    snprintf(report, sizeof(report), "%.3f s festival core",
+             festivald_now() - start);
+    std::cerr << "startup: " << report << std::endl;
+    if (!load_init_files)
+        return;
+
+    init_subr_1("festivald.profile_begin", festivald_profile_begin,
+                "(festivald.profile_begin FILE)\n"
+                "  Marks the start of loading FILE, for festivald --profile-startup.");
+    init_subr_1("festivald.profile_end", festivald_profile_end,
+                "(festivald.profile_end FILE)\n"
+                "  Marks the end of loading FILE, for festivald --profile-startup.");
+    festival_eval_command(profile_load_wrapper);
+
+    // The default setup files, as loaded by festival_initialize(). The
+    // load wrapper already times them
+    std::string init = std::string(festival_libdir) + "/init.scm";
+    if (access(init.c_str(), R_OK) == 0)
+        festival_load_file(init.c_str());
+    else
+        std::cerr << "Initialization file " << init << " not found"
+                  << std::endl;
+    if (getenv("HOME") != 0) {
+        std::string rc = std::string(getenv("HOME")) + "/.festivalrc";
+        if (access(rc.c_str(), R_OK) == 0)
+            festival_load_file(rc.c_str());
+    }
+    festival_eval_command("(set! load festivald.load)");
+
+    for (std::map<std::string, double>::const_iterator v =
+             profile_voices.begin();
+         v != profile_voices.end(); ++v) {
+        snprintf(report, sizeof(report), "%.3f s", v->second);
+        std::cerr << "startup: voice " << v->first << ": " << report
+                  << std::endl;
+    }
+}
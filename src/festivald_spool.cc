@@ -0,0 +1,502 @@
+/*************************************************************************/
+/*                                                                       */
+/*                Centre for Speech Technology Research                  */
+/*                     University of Edinburgh, UK                       */
+/*                       Copyright (c) 1996,1997                         */
+/*           Sergio Oller Moreno, Barcelona, Spain (c) 2018              */
+/*                        All Rights Reserved.                           */
+/*                                                                       */
+/*  Permission is hereby granted, free of charge, to use and distribute  */
+/*  this software and its documentation without restriction, including   */
+/*  without limitation the rights to use, copy, modify, merge, publish,  */
+/*  distribute, sublicense, and/or sell copies of this work, and to      */
+/*  permit persons to whom this work is furnished to do so, subject to   */
+/*  the following conditions:                                            */
+/*   1. The code must retain the above copyright notice, this list of    */
+/*      conditions and the following disclaimer.                         */
+/*   2. Any modifications must be clearly marked as such.                */
+/*   3. Original authors' names are not deleted.                         */
+/*   4. The authors' names are not used to endorse or promote products   */
+/*      derived from this software without specific prior written        */
+/*      permission.                                                      */
+/*                                                                       */
+/*  THE UNIVERSITY OF EDINBURGH AND THE CONTRIBUTORS TO THIS WORK        */
+/*  DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE, INCLUDING      */
+/*  ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO EVENT   */
+/*  SHALL THE UNIVERSITY OF EDINBURGH NOR THE CONTRIBUTORS BE LIABLE     */
+/*  FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES    */
+/*  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN   */
+/*  AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION,          */
+/*  ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF       */
+/*  THIS SOFTWARE.                                                       */
+/*                                                                       */
+/*************************************************************************/
+/* Author : festivald contributors                                       */
+/*                                                                       */
+/* Batch synthesis of text files (spool mode) for festivald              */
+/*                                                                       */
+/*=======================================================================*/
+
+// Standard includes
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+
+// POSIX includes
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// speech-tools and festival includes:
+#include <EST_String.h>
+#include <EST_Wave.h>
+#include <festival.h>
+#include <siod.h> /* init_subr_1 */
+
+#include "festivald_clock.h"
+#include "festivald_spool.h"
+
+static bool ends_with(const std::string& s, const std::string& suffix) {
+    return (s.size() >= suffix.size()) &&
+           (s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0);
+}
+
+static std::string dir_name(const std::string& path) {
+    size_t slash = path.rfind('/');
+    if (slash == std::string::npos)
+        return ".";
+    if (slash == 0)
+        return "/";
+    return path.substr(0, slash);
+}
+
+static std::string base_name(const std::string& path) {
+    size_t slash = path.rfind('/');
+    if (slash == std::string::npos)
+        return path;
+    return path.substr(slash + 1);
+}
+
+/* Path of the text file for a spool entry. Manifest entries are relative to
+ * the manifest directory, directory entries to the spool directory */
+static std::string spool_text_file(const festivald_spool& sp,
+                                   const std::string& input) {
+    if (input[0] == '/')
+        return input;
+    if (sp.is_manifest)
+        return dir_name(sp.path) + "/" + input;
+    return sp.path + "/" + input;
+}
+
+/* Relative manifest entries keep their directories under the output
+ * directory, so that ch1/intro.txt and ch2/intro.txt do not collide */
+static std::string spool_output_file(const festivald_spool& sp,
+                                     const std::string& input) {
+    std::string name = base_name(input);
+    if (sp.is_manifest && input[0] != '/') {
+        name = input;
+        while (name.compare(0, 2, "./") == 0)
+            name.erase(0, 2);
+    }
+    if (ends_with(name, ".txt"))
+        name.erase(name.size() - 4);
+    return sp.output_dir + "/" + name + ".wav";
+}
+
+static spool_mtime file_mtime(const struct stat& st) {
+    return spool_mtime(st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+}
+
+static int sync_dir(const std::string& dir) {
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    int retval;
+    if (fd < 0)
+        return -1;
+    retval = fsync(fd);
+    close(fd);
+    return retval;
+}
+
+/* Creates the missing directories leading to path */
+static int make_parent_dirs(const std::string& path) {
+    for (size_t slash = path.find('/', 1); slash != std::string::npos;
+         slash = path.find('/', slash + 1)) {
+        std::string dir = path.substr(0, slash);
+        if (mkdir(dir.c_str(), 0755) == 0) {
+            sync_dir(dir_name(dir));
+        } else if (errno != EEXIST) {
+            std::cerr << "spool: can't create \"" << dir
+                      << "\": " << strerror(errno) << std::endl;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void spool_enqueue(festivald_spool& sp, const std::string& input) {
+    if (sp.done.count(input) || sp.failed.count(input) ||
+        sp.queued.count(input))
+        return;
+    sp.pending.push_back(input);
+    sp.queued.insert(input);
+}
+
+/* Reads the journal of finished files. Each line is
+ * "<seconds of audio> <seconds spent> <input>" */
+static int spool_load_journal(festivald_spool& sp,
+                              const std::string& journal_path) {
+    std::ifstream journal(journal_path.c_str());
+    std::string line;
+    while (std::getline(journal, line)) {
+        double audio, spent;
+        int name_start = 0;
+        if (sscanf(line.c_str(), "%lf %lf %n", &audio, &spent, &name_start) <
+                2 ||
+            name_start == 0 || (size_t)name_start >= line.size())
+            continue;
+        sp.done.insert(line.substr(name_start));
+    }
+    sp.journal_fd =
+        open(journal_path.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (sp.journal_fd < 0) {
+        std::cerr << "spool: can't open journal \"" << journal_path
+                  << "\": " << strerror(errno) << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+/* Loads the manifest, refusing entries that would leave the output
+ * directory or overwrite the output of another entry */
+static int spool_load_manifest(festivald_spool& sp) {
+    std::ifstream manifest(sp.path.c_str());
+    std::map<std::string, std::string> outputs;
+    std::string line;
+    if (!manifest) {
+        std::cerr << "spool: can't open manifest \"" << sp.path << "\""
+                  << std::endl;
+        return -1;
+    }
+    while (std::getline(manifest, line)) {
+        if (line.empty() || line[0] == '#')
+            continue;
+        std::string output = spool_output_file(sp, line);
+        if (line[0] != '/' && ("/" + line + "/").find("/../") !=
+                                  std::string::npos) {
+            std::cerr << "spool: manifest entry \"" << line
+                      << "\" leaves the output directory" << std::endl;
+            return -1;
+        }
+        std::map<std::string, std::string>::iterator other =
+            outputs.find(output);
+        if (other != outputs.end() && other->second != line) {
+            std::cerr << "spool: manifest entries \"" << other->second
+                      << "\" and \"" << line << "\" both render to \""
+                      << output << "\"" << std::endl;
+            return -1;
+        }
+        outputs[output] = line;
+        spool_enqueue(sp, line);
+    }
+    return 0;
+}
+
+/* Queues the *.txt files of the spool directory that are not done yet.
+ * Writers should create the files under another name and rename them, so
+ * half written files are never picked up */
+static void spool_scan(festivald_spool& sp) {
+    DIR* dir;
+    struct dirent* entry;
+    std::vector<std::string> names;
+
+    sp.last_scan = festivald_now();
+    if (sp.is_manifest)
+        return;
+    if ((dir = opendir(sp.path.c_str())) == NULL) {
+        std::cerr << "spool: can't read \"" << sp.path
+                  << "\": " << strerror(errno) << std::endl;
+        return;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        std::string name = entry->d_name;
+        struct stat st;
+        if (name[0] == '.' || !ends_with(name, ".txt"))
+            continue;
+        if (stat(spool_text_file(sp, name).c_str(), &st) < 0 ||
+            !S_ISREG(st.st_mode))
+            continue;
+        std::map<std::string, spool_mtime>::iterator failed =
+            sp.failed.find(name);
+        if (failed != sp.failed.end() && failed->second != file_mtime(st))
+            sp.failed.erase(failed);
+        names.push_back(name);
+    }
+    closedir(dir);
+    std::sort(names.begin(), names.end());
+    for (size_t i = 0; i < names.size(); i++)
+        spool_enqueue(sp, names[i]);
+}
+
+/* Sets up the spool at path (a directory or a manifest file). Output
+ * waveforms and the journal go to output_dir, by default the spool directory
+ * or the directory of the manifest.
+ * Returns 0 if ok. Returns <0 on error. */
+int spool_init(festivald_spool& sp, const char* path, const char* output_dir,
+               int max_jobs) {
+    struct stat st;
+
+    sp.path = path;
+    sp.max_jobs = max_jobs;
+    sp.journal_fd = -1;
+    sp.last_scan = 0;
+    sp.batch_active = false;
+    sp.batch_start = 0;
+    sp.batch_done = 0;
+    sp.batch_failed = 0;
+    sp.batch_audio = 0;
+
+    if (stat(path, &st) < 0) {
+        std::cerr << "spool: \"" << path << "\": " << strerror(errno)
+                  << std::endl;
+        return -1;
+    }
+    sp.is_manifest = !S_ISDIR(st.st_mode);
+    if (output_dir != NULL)
+        sp.output_dir = output_dir;
+    else if (sp.is_manifest)
+        sp.output_dir = dir_name(sp.path);
+    else
+        sp.output_dir = sp.path;
+
+    if (stat(sp.output_dir.c_str(), &st) < 0 || !S_ISDIR(st.st_mode)) {
+        std::cerr << "spool: output directory \"" << sp.output_dir
+                  << "\" does not exist" << std::endl;
+        return -1;
+    }
+    if (spool_load_journal(sp, sp.output_dir + "/" SPOOL_JOURNAL_NAME) < 0)
+        return -1;
+    if (sp.is_manifest && spool_load_manifest(sp) < 0)
+        return -1;
+    spool_scan(sp);
+    std::cerr << "spool: " << sp.done.size() << " files already done, "
+              << sp.pending.size() << " to render" << std::endl;
+    return 0;
+}
+
+/* Gives the next file to render, if the spool has a free job slot */
+bool spool_next_job(festivald_spool& sp, festivald_spool_job& job) {
+    if ((int)sp.running.size() >= sp.max_jobs || sp.pending.empty())
+        return false;
+    job.input = sp.pending.front();
+    job.text_file = spool_text_file(sp, job.input);
+    job.output = spool_output_file(sp, job.input);
+    job.result_fd = -1;
+    job.result.clear();
+    job.started = festivald_now();
+    sp.pending.pop_front();
+    return true;
+}
+
+void spool_job_started(festivald_spool& sp, const festivald_spool_job& job) {
+    if (!sp.batch_active) {
+        sp.batch_active = true;
+        sp.batch_start = job.started;
+        sp.batch_done = 0;
+        sp.batch_failed = 0;
+        sp.batch_audio = 0;
+    }
+    sp.running.push_back(job);
+}
+
+/* The waveform of the job a worker renders, one utterance after another */
+static EST_Wave spool_wave;
+
+static LISP festivald_spool_append(LISP lwave) {
+    EST_Wave* w = wave(lwave);
+
+    // An empty wave has a default sample rate that should not be kept
+    if (spool_wave.num_samples() == 0)
+        spool_wave = *w;
+    else
+        spool_wave += *w;
+    return NIL;
+}
+
+/* Quotes s as a Scheme string */
+static std::string scheme_string(const std::string& s) {
+    std::string quoted = "\"";
+    for (size_t i = 0; i < s.size(); i++) {
+        if ((s[i] == '"') || (s[i] == '\\'))
+            quoted += '\\';
+        quoted += s[i];
+    }
+    return quoted + "\"";
+}
+
+/* Renders a job in a worker. The text is synthesized utterance by utterance
+ * through tts_hooks, as festival --tts would, and the waves are appended.
+ * The waveform is written to a temporary file and renamed, so an existing
+ * output is always complete. On success the seconds of audio are written to
+ * the job result_fd.
+ * Returns 0 if ok. Returns <0 on error. */
+int spool_render(const festivald_spool_job& job) {
+    std::string tmp_output = job.output + ".part";
+    char result[64];
+    int fd;
+
+    if (access(job.text_file.c_str(), R_OK) != 0) {
+        std::cerr << "spool: can't open \"" << job.text_file << "\""
+                  << std::endl;
+        return -1;
+    }
+    init_subr_1("festivald.spool_append", festivald_spool_append,
+                "(festivald.spool_append WAVE)\n"
+                "  Appends WAVE to the output of a festivald spool job.");
+    festival_eval_command(
+        "(set! tts_hooks"
+        "  (list utt.synth"
+        "        (lambda (utt)"
+        "          (if (utt.relation.present utt 'Wave)"
+        "              (festivald.spool_append (utt.wave utt))))))");
+    if (!festival_eval_command(
+            ("(tts " + scheme_string(job.text_file) + " nil)").c_str())) {
+        std::cerr << "spool: can't synthesize \"" << job.text_file << "\""
+                  << std::endl;
+        return -1;
+    }
+    if (make_parent_dirs(job.output) < 0)
+        return -1;
+    if (spool_wave.save(tmp_output.c_str(), "riff") != write_ok) {
+        std::cerr << "spool: can't write \"" << tmp_output << "\"" << std::endl;
+        unlink(tmp_output.c_str());
+        return -1;
+    }
+    if ((fd = open(tmp_output.c_str(), O_RDONLY)) >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+    if (rename(tmp_output.c_str(), job.output.c_str()) < 0) {
+        std::cerr << "spool: can't rename \"" << tmp_output
+                  << "\": " << strerror(errno) << std::endl;
+        unlink(tmp_output.c_str());
+        return -1;
+    }
+    // The journal must not record a rename that a crash could still undo
+    if (sync_dir(dir_name(job.output)) < 0) {
+        std::cerr << "spool: can't sync the directory of \"" << job.output
+                  << "\": " << strerror(errno) << std::endl;
+        return -1;
+    }
+    snprintf(result, sizeof(result), "%.3f\n",
+             spool_wave.sample_rate() > 0
+                 ? (double)spool_wave.num_samples() / spool_wave.sample_rate()
+                 : 0.0);
+    if (write(job.result_fd, result, strlen(result)) < 0)
+        return -1;
+    return 0;
+}
+
+static void spool_report(festivald_spool& sp) {
+    double elapsed = festivald_now() - sp.batch_start;
+    char report[256];
+
+    snprintf(report, sizeof(report),
+             "spool: finished %d files (%d failed) in %.1f s, %.1f s of "
+             "audio: real-time factor %.3f, %.2f files/min",
+             sp.batch_done, sp.batch_failed, elapsed, sp.batch_audio,
+             sp.batch_audio > 0 ? elapsed / sp.batch_audio : 0.0,
+             elapsed > 0 ? 60.0 * sp.batch_done / elapsed : 0.0);
+    std::cerr << report << std::endl;
+    sp.batch_active = false;
+}
+
+static void spool_job_finished(festivald_spool& sp,
+                               const festivald_spool_job& job) {
+    double spent = festivald_now() - job.started;
+    double audio;
+    char entry[64];
+
+    sp.queued.erase(job.input);
+    if (sscanf(job.result.c_str(), "%lf", &audio) != 1) {
+        struct stat st;
+        std::cerr << "spool: " << job.input << ": failed" << std::endl;
+        sp.failed[job.input] = stat(job.text_file.c_str(), &st) == 0
+                                   ? file_mtime(st)
+                                   : spool_mtime(0, 0);
+        sp.batch_failed++;
+        return;
+    }
+    snprintf(entry, sizeof(entry), "%.3f %.3f ", audio, spent);
+    std::string line = entry + job.input + "\n";
+    if (write(sp.journal_fd, line.data(), line.size()) < 0 ||
+        fsync(sp.journal_fd) < 0) {
+        std::cerr << "spool: can't write journal: " << strerror(errno)
+                  << std::endl;
+    }
+    sp.done.insert(job.input);
+    sp.batch_done++;
+    sp.batch_audio += audio;
+    snprintf(entry, sizeof(entry), ": %.1f s of audio in %.1f s", audio,
+             spent);
+    std::cerr << "spool: " << job.input << entry << std::endl;
+}
+
+/* Appends one pollfd per running job, in the order of sp.running */
+void spool_poll_fds(festivald_spool& sp, std::vector<struct pollfd>& fds) {
+    for (size_t i = 0; i < sp.running.size(); i++) {
+        struct pollfd p;
+        p.fd = sp.running[i].result_fd;
+        p.events = POLLIN;
+        p.revents = 0;
+        fds.push_back(p);
+    }
+}
+
+/* Collects the job results and scans the spool directory when it is due.
+ * A job is over when its worker closes result_fd */
+void spool_handle_events(festivald_spool& sp, const struct pollfd* fds) {
+    for (size_t i = sp.running.size(); i-- > 0;) {
+        festivald_spool_job& job = sp.running[i];
+        char buf[64];
+        ssize_t n;
+
+        if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+            continue;
+        n = read(job.result_fd, buf, sizeof(buf));
+        if (n > 0) {
+            job.result.append(buf, n);
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+            continue;
+        close(job.result_fd);
+        spool_job_finished(sp, job);
+        sp.running.erase(sp.running.begin() + i);
+    }
+    if (!sp.is_manifest &&
+        festivald_now() - sp.last_scan >= SPOOL_SCAN_INTERVAL)
+        spool_scan(sp);
+    if (sp.batch_active && sp.running.empty() && sp.pending.empty())
+        spool_report(sp);
+}
+
+/* Milliseconds until the spool directory has to be scanned again, or -1 */
+int spool_timeout(const festivald_spool& sp) {
+    if (sp.is_manifest)
+        return -1;
+    double left = sp.last_scan + SPOOL_SCAN_INTERVAL - festivald_now();
+    return left > 0 ? (int)(left * 1000) + 1 : 0;
+}
+
+/* Closes in a worker the descriptors owned by the master */
+void spool_close_fds(festivald_spool& sp) {
+    if (sp.journal_fd != -1)
+        close(sp.journal_fd);
+    for (size_t i = 0; i < sp.running.size(); i++)
+        close(sp.running[i].result_fd);
+}
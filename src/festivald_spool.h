@@ -0,0 +1,102 @@
+/*************************************************************************/
+/*                                                                       */
+/*                Centre for Speech Technology Research                  */
+/*                     University of Edinburgh, UK                       */
+/*                       Copyright (c) 1996,1997                         */
+/*           Sergio Oller Moreno, Barcelona, Spain (c) 2018              */
+/*                        All Rights Reserved.                           */
+/*                                                                       */
+/*  Permission is hereby granted, free of charge, to use and distribute  */
+/*  this software and its documentation without restriction, including   */
+/*  without limitation the rights to use, copy, modify, merge, publish,  */
+/*  distribute, sublicense, and/or sell copies of this work, and to      */
+/*  permit persons to whom this work is furnished to do so, subject to   */
+/*  the following conditions:                                            */
+/*   1. The code must retain the above copyright notice, this list of    */
+/*      conditions and the following disclaimer.                         */
+/*   2. Any modifications must be clearly marked as such.                */
+/*   3. Original authors' names are not deleted.                         */
+/*   4. The authors' names are not used to endorse or promote products   */
+/*      derived from this software without specific prior written        */
+/*      permission.                                                      */
+/*                                                                       */
+/*  THE UNIVERSITY OF EDINBURGH AND THE CONTRIBUTORS TO THIS WORK        */
+/*  DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE, INCLUDING      */
+/*  ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO EVENT   */
+/*  SHALL THE UNIVERSITY OF EDINBURGH NOR THE CONTRIBUTORS BE LIABLE     */
+/*  FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES    */
+/*  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN   */
+/*  AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION,          */
+/*  ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF       */
+/*  THIS SOFTWARE.                                                       */
+/*                                                                       */
+/*************************************************************************/
+/* Author : festivald contributors                                       */
+/*                                                                       */
+/* Batch synthesis of text files (spool mode) for festivald              */
+/*                                                                       */
+/*=======================================================================*/
+
+#ifndef FESTIVALD_SPOOL_H
+#define FESTIVALD_SPOOL_H
+
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <poll.h>
+#include <time.h>
+
+#define DEFAULT_SPOOL_JOBS 1
+#define SPOOL_SCAN_INTERVAL 2
+#define SPOOL_JOURNAL_NAME "festivald.journal"
+
+/* A text file being rendered by a spool worker */
+struct festivald_spool_job {
+    std::string input;     // as listed in the manifest or the spool directory
+    std::string text_file; // path of the text to render
+    std::string output;    // path of the waveform to write
+    int result_fd;      // the worker writes here the seconds of audio produced
+    std::string result;
+    double started;
+};
+
+/* Modification time of a text file, to retry it once it changes */
+typedef std::pair<time_t, long> spool_mtime;
+
+/* The spool: a directory watched for *.txt files or a manifest listing one
+ * text file per line. Finished files are recorded in a journal next to the
+ * output waveforms, so an interrupted spool resumes where it stopped */
+struct festivald_spool {
+    std::string path;
+    bool is_manifest;
+    std::string output_dir;
+    int max_jobs;
+    int journal_fd;
+    std::set<std::string> done;
+    std::map<std::string, spool_mtime> failed; // until their text changes
+    std::set<std::string> queued; // pending or running
+    std::deque<std::string> pending;
+    std::vector<festivald_spool_job> running;
+    double last_scan;
+    // Statistics of the current batch, reported once the spool is drained
+    bool batch_active;
+    double batch_start;
+    int batch_done;
+    int batch_failed;
+    double batch_audio;
+};
+
+int spool_init(festivald_spool& sp, const char* path, const char* output_dir,
+               int max_jobs);
+bool spool_next_job(festivald_spool& sp, festivald_spool_job& job);
+void spool_job_started(festivald_spool& sp, const festivald_spool_job& job);
+int spool_render(const festivald_spool_job& job);
+void spool_poll_fds(festivald_spool& sp, std::vector<struct pollfd>& fds);
+void spool_handle_events(festivald_spool& sp, const struct pollfd* fds);
+int spool_timeout(const festivald_spool& sp);
+void spool_close_fds(festivald_spool& sp);
+
+#endif